@@ -1,22 +1,123 @@
 /*** includes ***/
+// макросы включения возможностей (feature test macros): без них при `-std=c99` заголовки не объявляют часть
+// POSIX-функций, например, `clock_gettime`. Должны стоять до подключения заголовков.
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <termios.h>
+#include <time.h>
+#include <ucontext.h>
 #include <unistd.h>
 
+// статические точки трассировки (USDT). Если есть `sys/sdt.h` (пакет `systemtap-sdt-dev`), в ключевых местах программы
+// появляются пробы `kilo:*`, к которым можно подключиться через `bpftrace` или `perf` без пересборки. Пока к пробе
+// никто не подключен, на ее месте стоит одна инструкция `nop`. У каждой пробы есть семафор - счетчик, который
+// трассировщик увеличивает при подключении. Если для аргументов пробы нужно что-то вычислять, это делается только при
+// ненулевом семафоре, иначе работа тратилась бы и без трассировщика.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define KILO_USDT
+#endif
+#endif
+
 /*** defines ***/
 // Макрос применяет операцию побитового "И" к переданному символу и меняет старшие 3 бита на 0. Это отражает то, что
 // делает `Ctrl` в терминале - обнуляет старшие 2 (два) бита. 5 бит (нумерация с нуля) в наборе симоволов ASCII отвечает
 // за регистр: установкой и снятием бита осуществляется переключение между нижним и верхним регистром.
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+// точки трассировки, см. комментарий к `sys/sdt.h`. Без `sys/sdt.h` макросы ничего не делают.
+// `KILO_PROBE_ENABLED` проверяет семафор пробы: подключен ли к ней трассировщик.
+#ifdef KILO_USDT
+#define KILO_PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short kilo_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+#define KILO_PROBE_ENABLED(name) __builtin_expect(kilo_##name##_semaphore, 0)
+#define KILO_PROBE1(name, a) DTRACE_PROBE1(kilo, name, a)
+#define KILO_PROBE2(name, a, b) DTRACE_PROBE2(kilo, name, a, b)
+
+// семафоры всех проб: с `_SDT_HAS_SEMAPHORES` каждая проба ссылается на свой семафор
+KILO_PROBE_SEMAPHORE(key);
+KILO_PROBE_SEMAPHORE(dispatch);
+KILO_PROBE_SEMAPHORE(frame_composed);
+KILO_PROBE_SEMAPHORE(frame_written);
+#else
+#define KILO_PROBE_ENABLED(name) 0
+#define KILO_PROBE1(name, a) do {} while (0)
+#define KILO_PROBE2(name, a, b) do {} while (0)
+#endif
+
 // константа с версией
 #define KILO_VERSION "0.0.1"
 
+// размер буфера ввода: столько байт можно считать из терминала за один вызов `read`
+#define KILO_INPUT_SIZE 256
+// кольцо порций ввода между потоком чтения и главным потоком: количество порций (обязательно степень двойки)
+#define KILO_INPUT_RING 64
+// сколько ждать продолжения `escape`-последовательности, в миллисекундах
+#define KILO_INPUT_TIMEOUT_MS 100
+
+// пока ввод приходит пачкой, кадры пропускаются, но не дольше, чем на столько клавиш или миллисекунд: при длинной
+// вставке или автоповторе клавиши на медленной линии экран все равно должен обновляться
+#define KILO_DEFER_KEYS 64
+#define KILO_DEFER_MS 50
+
+// колесо таймеров: длительность одного деления в миллисекундах, количество ячеек точного уровня (один оборот - 2.56
+// секунды) и количество ячеек грубого уровня, каждая из которых - один оборот точного (всего около 164 секунд).
+// Количество ячеек каждого уровня - степень двойки, кратная 64 (см. `timerSlotDistance`).
+#define KILO_TIMER_TICK_MS 10
+#define KILO_TIMER_SLOTS 256
+#define KILO_TIMER_COARSE_SLOTS 64
+
+// профиль "низкая задержка": сколько миллисекунд после последнего ввода опрашивать терминал без засыпания
+#define KILO_SPIN_MS 50
+// профиль "экономия энергии": до скольких миллисекунд округляется время ожидания таймеров, чтобы близкие таймеры
+// срабатывали за одно пробуждение
+#define KILO_COALESCE_MS 50
+
+// порог сторожа медленных кадров по умолчанию, в миллисекундах (меняется переменной окружения `KILO_WATCHDOG_MS`)
+#define KILO_WATCHDOG_MS 50
+
+// профилировщик: интервал между выборками в микросекундах процессорного времени, размер кольца выборок (обязательно
+// степень двойки), сколько адресов стека сохранять в выборке, сколько разных функций различать в сводке и сколько
+// самых горячих показывать
+#define KILO_PROFILE_INTERVAL_US 1000
+#define KILO_PROFILE_RING 4096
+#define KILO_PROFILE_DEPTH 4
+#define KILO_PROFILE_FUNCS 64
+#define KILO_PROFILE_TOP 5
+
+// профилировщику нужно достать адрес текущей инструкции и указатель кадра из контекста, переданного обработчику
+// сигнала. Где лежат эти регистры, зависит от архитектуры, поэтому профилировщик есть только там, где это описано ниже.
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+#define KILO_PROFILER
+#endif
+
+// замер задержки терминала: количество корзин гистограммы (граница первой корзины - 250 микросекунд, каждой следующей -
+// вдвое больше, последняя корзина - все, что больше) и через сколько миллисекунд перестать ждать ответа терминала
+#define KILO_PROBE_BUCKETS 10
+#define KILO_PROBE_TIMEOUT_MS 1000
+// сколько запросов может остаться без ответа, прежде чем новые перестанут отправляться (терминал, видимо, не отвечает
+// на DA1)
+#define KILO_PROBE_MAX_OUTSTANDING 4
+
 // константы для использования в функциях обработки ввода
 enum editorKey {
 	ARROW_LEFT = 1000,
@@ -27,10 +128,61 @@ enum editorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	// не клавиша, а ответ терминала на запрос `Device Attributes` (см. замер задержки терминала)
+	TERMINAL_REPLY
+};
+
+// почему проснулся главный поток (см. `editorWaitInput`)
+enum editorWakeup {
+	// есть ввод
+	WAKE_INPUT,
+	// сработал хотя бы один таймер
+	WAKE_TIMERS,
+	// терминал принял остаток кадра
+	WAKE_OUTPUT
+};
+
+// профили задержки, выбираются переменной окружения `KILO_LATENCY`
+enum editorLatencyProfile {
+	// по умолчанию: спим, пока нет ввода, близкие таймеры объединяются
+	LATENCY_POWER_SAVE,
+	// `KILO_LATENCY=low`: после ввода какое-то время ждем следующую клавишу без засыпания
+	LATENCY_LOW
 };
 
 /*** data ***/
+// Порция ввода: байты, считанные потоком чтения одним вызовом `read`, и время их прихода
+struct editorInputBatch {
+	struct timespec time;
+	int len;
+	char bytes[KILO_INPUT_SIZE];
+};
+
+// Строка сводки профилировщика: функция, сколько выборок пришлось на нее саму и сколько - на нее вместе с вызванными
+// из нее функциями
+struct editorHotspot {
+	const char *name;
+	long self;
+	long total;
+};
+
+// Таймер. Память под таймер выделяет тот, кто его использует (обычно это статическая переменная), поэтому добавление
+// и отмена таймера не требуют выделения памяти. Таймеры одной ячейки колеса связаны в двусвязный список.
+struct editorTimer {
+	// Соседи по списку ячейки
+	struct editorTimer *prev;
+	struct editorTimer *next;
+	// Ячейка колеса, в которой находится таймер (ячейки грубого уровня идут после ячеек точного)
+	int slot;
+	// Деление колеса, на котором таймер сработает
+	long expires;
+	// Таймер запущен и ждет срабатывания
+	int active;
+	// Функция, которая вызывается при срабатывании
+	void (*callback)(void);
+};
+
 // Конфигурация редактора, заполняется в процессе инициализации, изменяется в процессе работы. Отражает текущее
 // состояние редактора.
 struct editorConfig {
@@ -44,11 +196,417 @@ struct editorConfig {
 	int screenrows;
 	// Структура, хранящая настройки терминала
 	struct termios originalTermios;
+	// Терминал поддерживает команду `X` (ECH) - стирание символов без перемещения курсора
+	int termHasEch;
+	// Кольцо порций ввода. Поток чтения пишет порцию и сдвигает `inputHead`, главный поток забирает порцию и сдвигает
+	// `inputTail`. Индексы только растут, ячейка - индекс по модулю `KILO_INPUT_RING`.
+	struct editorInputBatch inputRing[KILO_INPUT_RING];
+	unsigned int inputHead;
+	unsigned int inputTail;
+	// Канал, через который поток чтения будит главный поток: по байту на каждую порцию
+	int inputWake[2];
+	// Поток чтения
+	pthread_t inputThread;
+	// Буфер ввода: порция, забранная из кольца, но еще не разобранная на клавиши
+	char input[KILO_INPUT_SIZE];
+	// Позиция первого неразобранного байта в буфере ввода
+	int inputPos;
+	// Количество байт в буфере ввода
+	int inputLen;
+	// Время прихода порции, которая сейчас в буфере ввода
+	struct timespec inputTime;
+	// Время прихода самой старой клавиши, которая еще не попала на экран
+	struct timespec keyTime;
+	// Задержка от прихода клавиши до вывода кадра на экран, в микросекундах
+	long keyLatency;
+	// Вывод в терминал без блокировки (см. `editorFlushOutput`): дескриптор терминала, открытый с `O_NONBLOCK`, кадр,
+	// который еще выводится (`NULL`, если вывод закончен), его размер и сколько байт уже принял терминал
+	int outFd;
+	char *out;
+	int outLen;
+	int outPos;
+	// Время окончания сборки выводимого кадра, время прихода клавиши, после которой он собран, и был ли вслед за ним
+	// отправлен запрос DA1
+	struct timespec outComposed;
+	struct timespec outKeyTime;
+	int outProbe;
+	// Ячейки колеса таймеров: сначала точный уровень, затем грубый. В каждой - список таймеров
+	struct editorTimer *timerSlots[KILO_TIMER_SLOTS + KILO_TIMER_COARSE_SLOTS];
+	// Карта занятых ячеек: по биту на ячейку
+	uint64_t timerMap[(KILO_TIMER_SLOTS + KILO_TIMER_COARSE_SLOTS) / 64];
+	// Текущее деление колеса (счет делений не сбрасывается по кругу)
+	long timerTick;
+	// Время, соответствующее текущему делению колеса
+	struct timespec timerTime;
+	// Количество запущенных таймеров
+	int timerCount;
+	// Деление, раньше которого не сработает ни один таймер (`-1` - неизвестно, нужно найти заново)
+	long timerNext;
+	// Профиль задержки (`enum editorLatencyProfile`)
+	int latencyProfile;
+	// Количество пробуждений после ожидания ввода
+	long wakeups;
+	// Количество пробуждений на момент прошлого обновления статистики и время этого обновления
+	long statsWakeups;
+	struct timespec statsTime;
+	// Пробуждений в секунду за последний замер
+	long wakeupsPerSec;
+	// Показывать статистику внизу экрана
+	int showStats;
+	// Таймер обновления статистики
+	struct editorTimer statsTimer;
+	// Последняя обработанная клавиша
+	int lastKey;
+	// Самая долгая обработка клавиши с прошлого кадра, в микросекундах
+	long dispatchUs;
+	// Время сборки и вывода последнего кадра, в микросекундах
+	long composeUs;
+	long writeUs;
+	// Файл журнала сторожа медленных кадров (`-1`, если сторож выключен) и его порог в микросекундах
+	int watchdogFd;
+	long watchdogUs;
+	// Профилировщик включен
+	int profiling;
+	// Граница стека главного потока (кадр `main`): выше нее обход стека из обработчика сигнала не заходит
+	uintptr_t profStackTop;
+	// Кольцо выборок. В выборке - адрес инструкции, на которой программу застал сигнал, и адреса возврата в вызывающие
+	// функции (`0` - стек дальше пройти не удалось). Заполняется обработчиком сигнала, поэтому `volatile`. Счетчик
+	// выборок беззнаковый: его переполнение определено и просто начинает кольцо заново.
+	volatile uintptr_t profRing[KILO_PROFILE_RING][KILO_PROFILE_DEPTH];
+	volatile unsigned long profSamples;
+	// Снимок самых горячих функций для вывода на экран и число выборок в снимке
+	struct editorHotspot profTop[KILO_PROFILE_TOP];
+	int profTopLen;
+	long profTotal;
+	// Замер задержки терминала включен
+	int termProbe;
+	// Запрос отправлен, ждем ответа; время отправки запроса
+	int probePending;
+	struct timespec probeTime;
+	// Сколько отправленных запросов еще без ответа, включая те, ждать которых перестали по таймеру
+	int probeOutstanding;
+	// Таймер, по которому перестаем ждать ответа, если терминал не ответил
+	struct editorTimer probeTimer;
+	// Гистограмма времени ответа терминала и количество ответов
+	long probeHist[KILO_PROBE_BUCKETS];
+	long probeCount;
 };
 
 // Объявляем переменную для последующего использования
 struct editorConfig config;
 
+/*** prototypes ***/
+int editorFlushOutput();
+
+/*** timers ***/
+// Отложенная работа редактора выполняется по таймерам, которые хранятся в колесе (timer wheel). Точный уровень колеса -
+// `KILO_TIMER_SLOTS` ячеек, каждая из которых соответствует делению в `KILO_TIMER_TICK_MS` миллисекунд. Таймер, до
+// которого меньше оборота точного уровня, кладется в ячейку, на которую придется его срабатывание. Более далекие
+// таймеры лежат на грубом уровне, где ячейка соответствует целому обороту точного. Когда точный уровень заканчивает
+// оборот, таймеры очередной грубой ячейки перекладываются (cascade) в точные ячейки. Таймеры дальше грубого уровня
+// лежат в его последней ячейке и при перекладывании снова попадают на грубый уровень. Добавление и отмена выполняются
+// за O(1). Время до ближайшего таймера запоминается, а ищется заново по карте занятых ячеек, только когда ближайший
+// таймер сработал или отменен. Поэтому ожидание длится до настоящего срабатывания таймера, а не до конца оборота
+// колеса.
+
+// возвращает разницу между двумя моментами времени в микросекундах
+long timeDiffUs(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+// Возвращает, через сколько ячеек после ячейки `from` находится ближайшая занятая ячейка уровня из `size` ячеек,
+// начинающегося с ячейки `base`, или `-1`, если уровень пуст. Сама ячейка `from` проверяется последней, на расстоянии
+// в целый оборот. Карта просматривается по 64 ячейки за раз, поэтому `base` и `size` кратны 64.
+int timerSlotDistance(int base, int size, int from) {
+	int distance = 1;
+
+	while (distance <= size) {
+		int slot = base + (from + distance) % size;
+		uint64_t word = config.timerMap[slot / 64] >> (slot % 64);
+
+		if (word) {
+			distance += __builtin_ctzll(word);
+			return distance <= size ? distance : -1;
+		}
+
+		distance += 64 - slot % 64;
+	}
+
+	return -1;
+}
+
+// Кладет запущенный таймер в ячейку колеса по времени его срабатывания
+void timerInsert(struct editorTimer *t) {
+	long delta = t->expires - config.timerTick;
+
+	if (delta < KILO_TIMER_SLOTS) {
+		t->slot = t->expires % KILO_TIMER_SLOTS;
+	} else {
+		// слишком далекий таймер кладем в последнюю ячейку грубого уровня
+		if (delta >= KILO_TIMER_SLOTS * KILO_TIMER_COARSE_SLOTS) {
+			delta = KILO_TIMER_SLOTS * KILO_TIMER_COARSE_SLOTS - 1;
+		}
+
+		t->slot = KILO_TIMER_SLOTS + (config.timerTick + delta) / KILO_TIMER_SLOTS % KILO_TIMER_COARSE_SLOTS;
+	}
+
+	// добавляем в начало списка ячейки
+	t->prev = NULL;
+	t->next = config.timerSlots[t->slot];
+	if (t->next) {
+		t->next->prev = t;
+	}
+	config.timerSlots[t->slot] = t;
+	config.timerMap[t->slot / 64] |= (uint64_t) 1 << (t->slot % 64);
+}
+
+// Отменяет таймер. Отмена незапущенного таймера ничего не делает.
+void timerCancel(struct editorTimer *t) {
+	if (!t->active) {
+		return;
+	}
+
+	if (t->prev) {
+		t->prev->next = t->next;
+	} else {
+		config.timerSlots[t->slot] = t->next;
+	}
+
+	if (t->next) {
+		t->next->prev = t->prev;
+	}
+
+	if (!config.timerSlots[t->slot]) {
+		config.timerMap[t->slot / 64] &= ~((uint64_t) 1 << (t->slot % 64));
+	}
+
+	// если это был ближайший таймер, ближайший нужно искать заново
+	if (t->expires == config.timerNext) {
+		config.timerNext = -1;
+	}
+
+	t->active = 0;
+	config.timerCount--;
+}
+
+// Запускает таймер, который через `delayMs` миллисекунд (с точностью до деления колеса) вызовет `callback`. Если таймер
+// уже был запущен, он перезапускается.
+void timerAdd(struct editorTimer *t, int delayMs, void (*callback)(void)) {
+	long ticks = (delayMs + KILO_TIMER_TICK_MS - 1) / KILO_TIMER_TICK_MS;
+
+	timerCancel(t);
+
+	if (ticks < 1) {
+		ticks = 1;
+	}
+
+	t->expires = config.timerTick + ticks;
+	t->callback = callback;
+	t->active = 1;
+	timerInsert(t);
+	config.timerCount++;
+
+	// если ближайший таймер известен, новый таймер может стать ближайшим; единственный таймер - ближайший
+	if (config.timerCount == 1 || (config.timerNext != -1 && t->expires < config.timerNext)) {
+		config.timerNext = t->expires;
+	}
+}
+
+// Перекладывает таймеры очередной ячейки грубого уровня в точный уровень (или, если они еще далеко, обратно в грубый).
+// Вызывается, когда точный уровень начинает новый оборот.
+void timerCascade() {
+	int slot = KILO_TIMER_SLOTS + config.timerTick / KILO_TIMER_SLOTS % KILO_TIMER_COARSE_SLOTS;
+	struct editorTimer *t = config.timerSlots[slot];
+
+	config.timerSlots[slot] = NULL;
+	config.timerMap[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+
+	while (t) {
+		struct editorTimer *next = t->next;
+		timerInsert(t);
+		t = next;
+	}
+}
+
+// Поворачивает колесо на столько делений, сколько прошло времени, и вызывает сработавшие таймеры. Пустые деления
+// пропускаются сразу до ближайшей занятой ячейки точного уровня или до конца его оборота. Возвращает количество
+// сработавших таймеров.
+int timerAdvance() {
+	struct timespec now;
+	long target;
+	int fired = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	target = config.timerTick + timeDiffUs(&config.timerTime, &now) / (KILO_TIMER_TICK_MS * 1000L);
+
+	while (config.timerTick < target && config.timerCount) {
+		long step = target - config.timerTick;
+		long turnEnd = KILO_TIMER_SLOTS - config.timerTick % KILO_TIMER_SLOTS;
+		int distance = timerSlotDistance(0, KILO_TIMER_SLOTS, config.timerTick % KILO_TIMER_SLOTS);
+		int slot;
+
+		if (distance != -1 && distance < step) {
+			step = distance;
+		}
+
+		if (turnEnd < step) {
+			step = turnEnd;
+		}
+
+		config.timerTick += step;
+		config.timerTime.tv_sec += step * KILO_TIMER_TICK_MS / 1000;
+		config.timerTime.tv_nsec += step * KILO_TIMER_TICK_MS % 1000 * 1000000L;
+		if (config.timerTime.tv_nsec >= 1000000000L) {
+			config.timerTime.tv_sec++;
+			config.timerTime.tv_nsec -= 1000000000L;
+		}
+
+		if (config.timerTick % KILO_TIMER_SLOTS == 0) {
+			timerCascade();
+		}
+
+		// таймер, запущенный из обработчика, попадает в другую ячейку, поэтому ячейка опустеет
+		slot = config.timerTick % KILO_TIMER_SLOTS;
+		while (config.timerSlots[slot]) {
+			struct editorTimer *t = config.timerSlots[slot];
+			timerCancel(t);
+			t->callback();
+			fired++;
+		}
+	}
+
+	// если таймеров не осталось, колесо можно не крутить: просто переносим его текущее деление на текущее время
+	if (!config.timerCount) {
+		config.timerTime = now;
+	}
+
+	// ближайшее деление, найденное по грубому уровню, может оказаться лишь временем перекладывания далекого таймера.
+	// Когда оно наступило, ближайший таймер ищем заново.
+	if (config.timerNext != -1 && config.timerNext <= config.timerTick) {
+		config.timerNext = -1;
+	}
+
+	return fired;
+}
+
+// Находит деление, раньше которого не сработает ни один таймер. На точном уровне это деление ближайшей занятой
+// ячейки. На грубом уровне просматривается только ближайшая занятая ячейка: таймеры в ней срабатывают раньше таймеров
+// следующих ячеек. Таймер, лежащий в ячейке, но срабатывающий позже (слишком далекий), учитывается временем
+// перекладывания ячейки.
+long timerFindNext() {
+	long next = -1;
+	long turn = config.timerTick / KILO_TIMER_SLOTS;
+	int distance = timerSlotDistance(0, KILO_TIMER_SLOTS, config.timerTick % KILO_TIMER_SLOTS);
+
+	if (distance != -1) {
+		next = config.timerTick + distance;
+	}
+
+	distance = timerSlotDistance(KILO_TIMER_SLOTS, KILO_TIMER_COARSE_SLOTS, turn % KILO_TIMER_COARSE_SLOTS);
+	if (distance != -1) {
+		long cascade = (turn + distance) * KILO_TIMER_SLOTS;
+		struct editorTimer *t = config.timerSlots[KILO_TIMER_SLOTS + (turn + distance) % KILO_TIMER_COARSE_SLOTS];
+
+		for (; t; t = t->next) {
+			long expires = t->expires < cascade + KILO_TIMER_SLOTS ? t->expires : cascade;
+
+			if (next == -1 || expires < next) {
+				next = expires;
+			}
+		}
+	}
+
+	return next;
+}
+
+// Возвращает, сколько миллисекунд можно ждать ввода до срабатывания ближайшего таймера, или `-1`, если таймеров нет и
+// ждать можно бесконечно. Ближайший таймер обычно уже известен, поэтому функция выполняется за O(1) и ее можно
+// вызывать при каждой проверке ввода.
+int timerTimeout() {
+	struct timespec now;
+
+	if (!config.timerCount) {
+		return -1;
+	}
+
+	if (config.timerNext == -1) {
+		config.timerNext = timerFindNext();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long timeout = (config.timerNext - config.timerTick) * KILO_TIMER_TICK_MS -
+		timeDiffUs(&config.timerTime, &now) / 1000;
+	if (timeout > INT_MAX) {
+		timeout = INT_MAX;
+	}
+
+	return timeout > 0 ? (int) timeout : 0;
+}
+
+/*** latency probe ***/
+// Замер задержки на стороне терминала (включается переменной окружения `KILO_TERM_PROBE`). Задержка редактора -
+// от прихода клавиши до вывода кадра - известна (`keyLatency`), но дальше кадр еще идет по сети и разбирается
+// терминалом. Чтобы это измерить, вслед за кадром, выведенным после нажатия клавиши, отправляется запрос `c` (Device
+// Attributes, DA1). Терминал отвечает на него только после того, как обработал все, что пришло до запроса, то есть и
+// сам кадр. Время от отправки запроса до прихода ответа складывается в гистограмму.
+
+// Перестает ждать ответа, если терминал не ответил вовремя (или вообще не отвечает на DA1). Запрос при этом остается
+// в `probeOutstanding`: если ответ все-таки придет, его нужно отличить от ответа на следующий запрос.
+void probeExpire() {
+	config.probePending = 0;
+}
+
+// Учитывает ответ терминала на запрос. Ответ пришел вместе с последней порцией ввода. Терминал отвечает на запросы по
+// порядку, поэтому, пока без ответа остается больше одного запроса, пришедший ответ относится к одному из старых,
+// ждать которых уже перестали, и не учитывается.
+void probeReply() {
+	long rtt;
+	int bucket = 0;
+
+	if (config.probeOutstanding > 0) {
+		config.probeOutstanding--;
+	}
+
+	if (!config.probePending || config.probeOutstanding > 0) {
+		return;
+	}
+
+	rtt = timeDiffUs(&config.probeTime, &config.inputTime);
+	while (bucket < KILO_PROBE_BUCKETS - 1 && rtt >= 250L << bucket) {
+		bucket++;
+	}
+
+	config.probeHist[bucket]++;
+	config.probeCount++;
+	config.probePending = 0;
+	timerCancel(&config.probeTimer);
+}
+
+// Возвращает номер корзины гистограммы, в которую попадает доля `percent` ответов терминала
+int probePercentile(int percent) {
+	long seen = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < KILO_PROBE_BUCKETS - 1; bucket++) {
+		seen += config.probeHist[bucket];
+		if (seen * 100 >= config.probeCount * percent) {
+			break;
+		}
+	}
+
+	return bucket;
+}
+
+// Записывает в `buf` границу корзины гистограммы: `< 500 us` или, для последней корзины, `>= 64000 us`
+int probeFormatBucket(char *buf, int size, int bucket) {
+	if (bucket < KILO_PROBE_BUCKETS - 1) {
+		return snprintf(buf, size, "< %ld us", 250L << bucket);
+	}
+
+	return snprintf(buf, size, ">= %ld us", 250L << (bucket - 1));
+}
+
 /*** terminal ***/
 // Обработчик ошибок. `tcsetattr`, `tcgetattr` и `read` возвращают `-1` в случае неудачи и устанавливают глобальную
 // переменную `errno`. `perror` использует `errno` и дополнительно выводит переданную строку.
@@ -147,8 +705,10 @@ void enableRawMode() {
 	// `VTIME` - максимальное время ожидания перед тем как `read` вернет результат. Значение измеряется в десятых долях
 	// секунды, поэтому `1` - это 100 миллисекунд. По прошествии этого времени `read` вернет `0` (это имеет смысл, т.к.
 	// обычно `read` возвращает число прочитанных байт).
-	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	// Терминал читает отдельный поток (см. `editorInputThread`), которому незачем просыпаться без ввода, поэтому `read`
+	// ждет хотя бы одного байта без ограничения по времени. Ожидание с таймаутом делает главный поток.
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
 
 	// устанавливаем настройки
 	// `TCSAFLUSH` определяет, когда применить изменения. В данном случае, программа ждет записи в терминал всех
@@ -164,18 +724,214 @@ void enableRawMode() {
 	}
 }
 
-// Ждет однократного нажатия клавиши и как только клавиша будет нажата, возвращает введенный символ.
-int editorReadKey() {
-	int nread;
-	char c;
+// Поток чтения. Терминал читает отдельный поток, который все время ждет в `read`, поэтому каждая порция ввода
+// помечается временем прихода, даже если главный поток в это время обрабатывает клавишу или выводит кадр. Порции
+// передаются главному потоку через кольцо с одним писателем и одним читателем: каждый из них сдвигает только свой
+// индекс, поэтому блокировки не нужны. При `-std=c99` нет `stdatomic.h`, поэтому используются встроенные функции
+// GCC `__atomic`: индекс сдвигается с `__ATOMIC_RELEASE` после того, как порция записана (или прочитана), а индекс
+// другой стороны читается с `__ATOMIC_ACQUIRE`.
+void *editorInputThread(void *arg) {
+	(void) arg;
+
+	while (1) {
+		unsigned int head = config.inputHead;
+		struct editorInputBatch *batch = &config.inputRing[head % KILO_INPUT_RING];
+
+		// кольцо заполнено: главный поток сильно отстал, ждем, пока он заберет порцию
+		if (head - __atomic_load_n(&config.inputTail, __ATOMIC_ACQUIRE) == KILO_INPUT_RING) {
+			struct timespec pause = {0, 1000000L};
+			nanosleep(&pause, NULL);
+			continue;
+		}
 
-	// в `Cygwin`, по истечении таймаута, `read` возвращает -1 и устанавливает `errno` в `EAGAIN` вместо того, чтобы
-	// возвращать `0`. Поэтому в `Cygwin` не считаем `EAGAIN` за ошибку.
-	// ждем ввода
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) {
+		int nread = read(STDIN_FILENO, batch->bytes, sizeof(batch->bytes));
+
+		if (nread == -1 && errno == EINTR) {
+			continue;
+		}
+
+		if (nread <= 0) {
 			die("read");
 		}
+
+		clock_gettime(CLOCK_MONOTONIC, &batch->time);
+		batch->len = nread;
+		__atomic_store_n(&config.inputHead, head + 1, __ATOMIC_RELEASE);
+
+		// будим главный поток. Если канал переполнен, главный поток и так проснется.
+		char wake = 0;
+		if (write(config.inputWake[1], &wake, 1) == -1 && errno != EAGAIN) {
+			die("write");
+		}
+	}
+
+	return NULL;
+}
+
+// Запускает поток чтения. Все сигналы в нем заблокированы: их, в том числе `SIGPROF` профилировщика, получает главный
+// поток.
+void editorInputStart() {
+	sigset_t all;
+	sigset_t old;
+
+	config.inputHead = 0;
+	config.inputTail = 0;
+
+	if (pipe(config.inputWake) == -1) {
+		die("pipe");
+	}
+
+	fcntl(config.inputWake[0], F_SETFL, O_NONBLOCK);
+	fcntl(config.inputWake[1], F_SETFL, O_NONBLOCK);
+
+	// поток наследует маску сигналов создавшего его потока
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&config.inputThread, NULL, editorInputThread, NULL) != 0) {
+		die("pthread_create");
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Проверяет, есть ли в кольце порция, которую главный поток еще не забрал. Системных вызовов не делает.
+int editorInputQueued() {
+	return __atomic_load_n(&config.inputHead, __ATOMIC_ACQUIRE) != config.inputTail;
+}
+
+// Вычитывает из канала пробуждения все накопившиеся байты. После этого главный поток проверяет кольцо: порция,
+// записанная позже, снова разбудит его через канал.
+void editorInputDrainWake() {
+	char buf[64];
+
+	while (read(config.inputWake[0], buf, sizeof(buf)) > 0) {
+	}
+}
+
+// Ждет порцию ввода не дольше `timeout` миллисекунд. Возвращает `1`, если порция есть в кольце.
+int editorWaitBatch(int timeout) {
+	struct pollfd pfd = {config.inputWake[0], POLLIN, 0};
+
+	if (editorInputQueued()) {
+		return 1;
+	}
+
+	if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+		die("poll");
+	}
+
+	editorInputDrainWake();
+	return editorInputQueued();
+}
+
+// Считывает один байт ввода. Байты отдаются из буфера, а когда он кончится, в буфер забирается следующая порция из
+// кольца вместе с временем ее прихода. Возвращает `1`, если байт считан, и `0`, если за `KILO_INPUT_TIMEOUT_MS`
+// ввода не было.
+int editorReadByte(char *c) {
+	if (config.inputPos == config.inputLen) {
+		if (!editorWaitBatch(KILO_INPUT_TIMEOUT_MS)) {
+			return 0;
+		}
+
+		struct editorInputBatch *batch = &config.inputRing[config.inputTail % KILO_INPUT_RING];
+
+		memcpy(config.input, batch->bytes, batch->len);
+		config.inputTime = batch->time;
+		config.inputPos = 0;
+		config.inputLen = batch->len;
+
+		// порция скопирована, ячейку можно отдать потоку чтения
+		__atomic_store_n(&config.inputTail, config.inputTail + 1, __ATOMIC_RELEASE);
+	}
+
+	*c = config.input[config.inputPos++];
+	return 1;
+}
+
+// Ждет ввода, попутно вызывая сработавшие таймеры и выводя остаток кадра. `read` с `VTIME` будил бы программу каждые
+// 100 миллисекунд даже без ввода; `poll` спит, пока поток чтения не разбудит главный поток, терминал не будет готов
+// принять остаток кадра или не наступит время ближайшего таймера. Возвращает причину пробуждения
+// (`enum editorWakeup`): есть ввод, сработал хотя бы один таймер (и, возможно, нужно перерисовать экран) или кадр
+// выведен целиком.
+int editorWaitInput() {
+	// пока кадр выводится, клавиши обрабатываются как обычно; перед каждой пробуем отдать терминалу еще часть кадра
+	if (config.out && editorFlushOutput()) {
+		return WAKE_OUTPUT;
+	}
+
+	if (config.inputPos < config.inputLen || editorInputQueued()) {
+		return WAKE_INPUT;
+	}
+
+	while (1) {
+		struct pollfd pfd[2] = {{config.inputWake[0], POLLIN, 0}, {config.outFd, POLLOUT, 0}};
+		int timeout = timerTimeout();
+		int ready = 0;
+
+		if (config.latencyProfile == LATENCY_LOW && !config.out) {
+			// пока с последнего ввода прошло немного времени, следующую клавишу ждем без засыпания: так она будет
+			// обработана сразу, без задержки на пробуждение процесса. Кольцо проверяется без системных вызовов.
+			// Ожидание прерывается, если пора вызывать таймеры. Пока кадр выводится, ждем в `poll`: он разбудит
+			// программу и тогда, когда терминал будет готов принять остаток кадра.
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			while (ready == 0 && timeout != 0 && timeDiffUs(&config.inputTime, &now) < KILO_SPIN_MS * 1000L) {
+				ready = editorInputQueued();
+				timeout = timerTimeout();
+				clock_gettime(CLOCK_MONOTONIC, &now);
+			}
+		} else if (timeout > 0) {
+			// округляем время ожидания вверх, чтобы таймеры, срабатывающие почти одновременно, обрабатывались за одно
+			// пробуждение
+			timeout = (timeout + KILO_COALESCE_MS - 1) / KILO_COALESCE_MS * KILO_COALESCE_MS;
+		}
+
+		if (ready == 0) {
+			// готовность терминала к выводу ждем, только пока есть что выводить
+			ready = poll(pfd, config.out ? 2 : 1, timeout);
+			config.wakeups++;
+		}
+
+		// `EINTR` - ожидание прервано сигналом, это не ошибка
+		if (ready == -1 && errno != EINTR) {
+			die("poll");
+		}
+
+		// байт в канале может остаться от порции, которую уже забрали, поэтому ввод проверяем по самому кольцу
+		editorInputDrainWake();
+		int fired = timerAdvance();
+		int written = config.out && (pfd[1].revents & (POLLOUT | POLLERR | POLLHUP)) && editorFlushOutput();
+
+		if (editorInputQueued()) {
+			return WAKE_INPUT;
+		}
+
+		if (fired) {
+			return WAKE_TIMERS;
+		}
+
+		if (written) {
+			return WAKE_OUTPUT;
+		}
+	}
+}
+
+// Ждет однократного нажатия клавиши и разбирает `escape`-последовательности. Вызывается из `editorReadKey`.
+int editorDecodeKey() {
+	char c;
+
+	// ждем ввода
+	while (!editorReadByte(&c)) {
+	}
+
+	// запоминаем, когда пришла клавиша, чтобы потом посчитать задержку до вывода кадра. Если клавиш, еще не попавших на
+	// экран, несколько, задержка считается от самой старой из них, поэтому время запоминается, только пока оно не
+	// задано. Если окажется, что это не клавиша, а ответ терминала, вернем прежнее значение.
+	struct timespec previousKeyTime = config.keyTime;
+	if (!config.keyTime.tv_sec && !config.keyTime.tv_nsec) {
+		config.keyTime = config.inputTime;
 	}
 
 	// нажатие клавиш управления курсором (стрелки) приводит к считыванию `escape`-последовательности.
@@ -184,12 +940,12 @@ int editorReadKey() {
 		char seq[3];
 
 		// считали первый байт после `escape`-символа (`[`)
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+		if (!editorReadByte(&seq[0])) {
 			return '\x1b';
 		}
 
 		// считали второй байт после `escape`-символа (символ команды)
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+		if (!editorReadByte(&seq[1])) {
 			return '\x1b';
 		}
 
@@ -202,9 +958,23 @@ int editorReadKey() {
 			// клавиша `delete` посылает последовательность `<esc>[3~`
 			// если третий байт в общей `escape`-последовательности соответствует клавишам 0 - 9, то, веротяно, это
 			// последовательность `home`, `end`, `del`, `page up` или `page down`
-			if (seq[1] >= '0' && seq[1] <= '9') {
+			if (seq[1] == '?') {
+				// ответ терминала на запрос DA1 выглядит как `<esc>[?64;1;2c`: параметры и завершающий байт `c`.
+				// дочитываем последовательность до завершающего байта (любой символ от `@` до `~`)
+				char end = 0;
+				int i = 0;
+
+				while (i++ < 32 && editorReadByte(&end) && (end < '@' || end > '~')) {
+				}
+
+				if (end == 'c') {
+					config.keyTime = previousKeyTime;
+					probeReply();
+					return TERMINAL_REPLY;
+				}
+			} else if (seq[1] >= '0' && seq[1] <= '9') {
 				// считываем третий байт
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+				if (!editorReadByte(&seq[2])) {
 					return '\x1b';
 				}
 
@@ -267,6 +1037,40 @@ int editorReadKey() {
 	}
 }
 
+// Проверяет, остался ли непрочитанный ввод: сначала в буфере ввода и кольце, затем в самом терминале. `FIONREAD`
+// возвращает число байт, которые уже пришли, но поток чтения их еще не считал.
+int editorInputPending() {
+	int pending;
+
+	if (config.inputPos < config.inputLen || editorInputQueued()) {
+		return 1;
+	}
+
+	if (ioctl(STDIN_FILENO, FIONREAD, &pending) == -1) {
+		return 0;
+	}
+
+	return pending > 0;
+}
+
+// Ждет однократного нажатия клавиши и как только клавиша будет нажата, возвращает введенный символ.
+// Проба `kilo:key` получает код клавиши и время от прихода самой старой еще не выведенной клавиши до конца разбора в
+// микросекундах.
+int editorReadKey() {
+	int c = editorDecodeKey();
+
+#ifdef KILO_USDT
+	// время разбора считаем, только если к пробе подключен трассировщик
+	if (KILO_PROBE_ENABLED(key)) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		KILO_PROBE2(key, c, timeDiffUs(&config.keyTime, &now));
+	}
+#endif
+
+	return c;
+}
+
 // получает положение курсора
 int getCursorPosition(int *rows, int *cols) {
 	char buf[32];
@@ -280,7 +1084,7 @@ int getCursorPosition(int *rows, int *cols) {
 	}
 
 	while (i < sizeof(buf) - 1) {
-		if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+		if (!editorReadByte(&buf[i])) {
 			break;
 		}
 
@@ -334,6 +1138,224 @@ int getWindowSize(int *rows, int *cols) {
 	}
 }
 
+/*** profiler ***/
+// Встроенный профилировщик на случай, когда на машине нет `perf`. Таймер `ITIMER_PROF` отсчитывает процессорное время
+// программы и по его истечении присылает `SIGPROF`. Обработчик сигнала записывает в заранее выделенное кольцо адрес
+// инструкции, на которой была программа, и проходит по указателям кадров на несколько вызовов вверх. Имена функций по
+// адресам находит `dladdr`, но уже не в обработчике, а при построении сводки. Чтобы `dladdr` видел функции самого
+// редактора, программа собирается с `-rdynamic`, а чтобы стек можно было пройти - с `-fno-omit-frame-pointer`.
+// Программа почти все время спит в `poll`, а процессорного времени во сне не тратится, поэтому выборки показывают, на
+// что уходит именно работа.
+
+// Обработчик `SIGPROF`. В обработчике можно только читать регистры и память стека, поэтому каждый указатель кадра
+// проверяется: он должен быть выровнен, лежать выше предыдущего и ниже кадра `main`. Так даже мусор в регистре кадра
+// (например, в библиотечной функции, собранной без указателей кадров) не приведет к чтению чужой памяти.
+void profilerSample(int sig, siginfo_t *info, void *context) {
+	ucontext_t *uc = context;
+	unsigned long slot = config.profSamples & (KILO_PROFILE_RING - 1);
+	uintptr_t pc = 0;
+	uintptr_t fp = 0;
+	uintptr_t sp = 0;
+	int depth;
+
+	(void) sig;
+	(void) info;
+	(void) uc;
+
+	// адрес инструкции, указатель кадра и вершина стека в момент сигнала
+#if defined(KILO_PROFILER) && defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(KILO_PROFILER) && defined(__i386__)
+	pc = uc->uc_mcontext.gregs[REG_EIP];
+	fp = uc->uc_mcontext.gregs[REG_EBP];
+	sp = uc->uc_mcontext.gregs[REG_ESP];
+#elif defined(KILO_PROFILER) && defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+	sp = uc->uc_mcontext.sp;
+#endif
+
+	config.profRing[slot][0] = pc;
+
+	// в кадре по адресу из указателя кадра лежит указатель кадра вызывающей функции, а за ним - адрес возврата в нее
+	for (depth = 1; depth < KILO_PROFILE_DEPTH; depth++) {
+		if (fp < sp || fp % sizeof(uintptr_t) || fp + 2 * sizeof(uintptr_t) > config.profStackTop) {
+			break;
+		}
+
+		config.profRing[slot][depth] = ((uintptr_t *) fp)[1];
+		sp = fp + 2 * sizeof(uintptr_t);
+		fp = ((uintptr_t *) fp)[0];
+	}
+
+	for (; depth < KILO_PROFILE_DEPTH; depth++) {
+		config.profRing[slot][depth] = 0;
+	}
+
+	config.profSamples++;
+}
+
+// Включает профилировщик, если задана переменная окружения `KILO_PROFILE` и архитектура поддерживается
+void profilerInit() {
+	struct sigaction sa;
+	struct itimerval timer;
+
+	config.profiling = getenv("KILO_PROFILE") != NULL;
+#ifndef KILO_PROFILER
+	config.profiling = 0;
+#endif
+	if (!config.profiling) {
+		return;
+	}
+
+	// `SA_SIGINFO`: обработчик получает контекст с регистрами.
+	// `SA_RESTART`: прерванные сигналом `read` и `write` перезапускаются, а не завершаются ошибкой `EINTR`
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = profilerSample;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) == -1) {
+		die("sigaction");
+	}
+
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = KILO_PROFILE_INTERVAL_US;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+		die("setitimer");
+	}
+}
+
+// Находит функцию, в которую попадает адрес: записывает в `start` ее начало, а в `name` - имя. Если имени нет (функция
+// не экспортирована), функцией считается вся библиотека, и именем будет имя ее файла. `dladdr` просматривает таблицу
+// символов, поэтому найденные адреса запоминаются в небольшом кэше: одни и те же адреса возврата встречаются в выборках
+// постоянно.
+void profilerResolve(uintptr_t pc, uintptr_t *start, const char **name) {
+	static struct {
+		uintptr_t pc;
+		uintptr_t start;
+		const char *name;
+	} cache[256];
+	int slot = (pc >> 2) & 255;
+	Dl_info info;
+
+	if (cache[slot].pc != pc) {
+		cache[slot].pc = pc;
+		cache[slot].start = 0;
+		cache[slot].name = "??";
+
+		if (dladdr((void *) pc, &info)) {
+			if (info.dli_sname) {
+				cache[slot].start = (uintptr_t) info.dli_saddr;
+				cache[slot].name = info.dli_sname;
+			} else if (info.dli_fname) {
+				const char *base = strrchr(info.dli_fname, '/');
+				cache[slot].start = (uintptr_t) info.dli_fbase;
+				cache[slot].name = base ? base + 1 : info.dli_fname;
+			}
+		}
+	}
+
+	*start = cache[slot].start;
+	*name = cache[slot].name;
+}
+
+// Собирает последние выборки из кольца по функциям и оставляет в снимке `KILO_PROFILE_TOP` самых горячих функций.
+// На время сборки `SIGPROF` блокируется, чтобы обработчик не переписал читаемую выборку.
+void profilerSnapshot() {
+	struct {
+		uintptr_t start;
+		struct editorHotspot spot;
+	} funcs[KILO_PROFILE_FUNCS];
+	int funcCount = 0;
+	sigset_t block;
+	sigset_t previous;
+	unsigned long samples;
+	unsigned long i;
+	int k;
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGPROF);
+	sigprocmask(SIG_BLOCK, &block, &previous);
+
+	samples = config.profSamples;
+	config.profTotal = samples < KILO_PROFILE_RING ? (long) samples : KILO_PROFILE_RING;
+
+	for (i = samples - config.profTotal; i != samples; i++) {
+		volatile uintptr_t *stack = config.profRing[i & (KILO_PROFILE_RING - 1)];
+		int seen[KILO_PROFILE_DEPTH];
+		int depth;
+
+		for (depth = 0; depth < KILO_PROFILE_DEPTH && stack[depth]; depth++) {
+			uintptr_t start;
+			const char *name;
+			int f;
+			int d;
+
+			// адрес возврата указывает на инструкцию после вызова, она может оказаться уже в следующей функции
+			profilerResolve(depth ? stack[depth] - 1 : stack[depth], &start, &name);
+
+			for (f = 0; f < funcCount && funcs[f].start != start; f++) {
+			}
+
+			if (f == funcCount) {
+				// функций больше, чем помещается в сводку: эту просто не учитываем
+				if (funcCount == KILO_PROFILE_FUNCS) {
+					seen[depth] = -1;
+					continue;
+				}
+
+				funcs[f].start = start;
+				funcs[f].spot.name = name;
+				funcs[f].spot.self = 0;
+				funcs[f].spot.total = 0;
+				funcCount++;
+			}
+
+			if (depth == 0) {
+				funcs[f].spot.self++;
+			}
+
+			// при рекурсии функция встречается в выборке несколько раз, но в общее число выборок идет один раз
+			for (d = 0; d < depth && seen[d] != f; d++) {
+			}
+			if (d == depth) {
+				funcs[f].spot.total++;
+			}
+			seen[depth] = f;
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &previous, NULL);
+
+	// выбираем самые горячие функции по одной: показывать нужно всего несколько. Сначала - по собственным выборкам,
+	// при равенстве - по выборкам вместе с вызванными функциями, так что после горячих функций идут их вызывающие.
+	config.profTopLen = 0;
+	for (k = 0; k < KILO_PROFILE_TOP; k++) {
+		int best = -1;
+		int f;
+
+		for (f = 0; f < funcCount; f++) {
+			struct editorHotspot *spot = &funcs[f].spot;
+
+			if (spot->total && (best == -1 || spot->self > funcs[best].spot.self ||
+				(spot->self == funcs[best].spot.self && spot->total > funcs[best].spot.total))) {
+				best = f;
+			}
+		}
+
+		if (best == -1) {
+			break;
+		}
+
+		config.profTop[k] = funcs[best].spot;
+		config.profTopLen++;
+		funcs[best].spot.total = 0;
+	}
+}
+
 /*** append buffer ***/
 // в си нет динамических строк, поэтому делаем собственную реализацию с одной операцией - добавлением
 
@@ -366,14 +1388,272 @@ void abAppend(struct abuf *ab, const char *s, int len) {
 	ab->len += len;
 }
 
+// добавляет в буфер `n` пробелов. Если терминал это поддерживает и так получается короче, вместо вывода пробелов байт
+// за байтом используется команда `X` (Erase Character): она стирает `n` символов, не двигая курсор, а затем `C` (Cursor
+// Forward) переводит курсор за стертый участок.
+void abAppendSpaces(struct abuf *ab, int n) {
+	char buf[32];
+	int len = 0;
+
+	if (n <= 0) {
+		return;
+	}
+
+	if (config.termHasEch) {
+		len = snprintf(buf, sizeof(buf), "\x1b[%dX\x1b[%dC", n, n);
+	}
+
+	// команда получилась не короче самих пробелов (или терминал ее не поддерживает) - выводим пробелы как есть
+	if (len == 0 || len >= n) {
+		while (n--) {
+			abAppend(ab, " ", 1);
+		}
+		return;
+	}
+
+	abAppend(ab, buf, len);
+}
+
 // работает как своеобразный деструктор. освобождает память, занятую буфером.
 void abFree(struct abuf *ab) {
 	free(ab->b);
 }
 
+/*** watchdog ***/
+// Сторож медленных кадров. Если обработка клавиши или вывод кадра заняли больше порога, в журнал (путь в переменной
+// окружения `KILO_WATCHDOG_LOG`) дописывается строка с тем, что было на экране и сколько времени ушло на каждую фазу.
+// По таким записям можно разобраться с жалобами на подвисания, не воспроизводя их.
+
+// Открывает журнал сторожа, если он задан в окружении. Порог берется из `KILO_WATCHDOG_MS`, если там положительное
+// число миллисекунд; иначе остается порог по умолчанию (с нулевым порогом в журнал попадал бы каждый кадр).
+void watchdogInit() {
+	const char *path = getenv("KILO_WATCHDOG_LOG");
+	const char *threshold = getenv("KILO_WATCHDOG_MS");
+	long ms = KILO_WATCHDOG_MS;
+
+	config.watchdogFd = -1;
+	if (path) {
+		config.watchdogFd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (config.watchdogFd == -1) {
+			die("open");
+		}
+	}
+
+	if (threshold) {
+		char *end;
+		long value;
+
+		errno = 0;
+		value = strtol(threshold, &end, 10);
+		if (errno == 0 && end != threshold && *end == '\0' && value > 0 && value <= LONG_MAX / 1000) {
+			ms = value;
+		}
+	}
+
+	config.watchdogUs = ms * 1000L;
+}
+
+// Проверяет времена последнего кадра и, если порог превышен, пишет запись в журнал. `frameBytes` - размер кадра.
+void watchdogCheck(int frameBytes) {
+	char record[256];
+	int len;
+
+	if (config.watchdogFd == -1) {
+		return;
+	}
+
+	if (config.dispatchUs <= config.watchdogUs && config.composeUs + config.writeUs <= config.watchdogUs) {
+		return;
+	}
+
+	len = snprintf(record, sizeof(record),
+		"time=%ld key=%d dispatch_us=%ld compose_us=%ld write_us=%ld frame_bytes=%d screen=%dx%d cursor=%d,%d\n",
+		(long) time(NULL), config.lastKey, config.dispatchUs, config.composeUs, config.writeUs, frameBytes,
+		config.screenrows, config.screencols, config.cy, config.cx);
+
+	// запись одним вызовом `write` с `O_APPEND` не перемешается с записями других запущенных редакторов
+	write(config.watchdogFd, record, len);
+}
+
 /*** output ***/
 // Пользовательский интерфейс будет перерисовываться с каждым нажатим какой-либо клавиши.
 
+// Обновляет статистику раз в секунду, пока она показывается на экране. Сам таймер добавляет одно пробуждение в секунду,
+// но только при включенной статистике.
+void editorStatsTick() {
+	struct timespec now;
+	long elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timeDiffUs(&config.statsTime, &now);
+
+	if (elapsed > 0) {
+		config.wakeupsPerSec = ((config.wakeups - config.statsWakeups) * 1000000L + elapsed / 2) / elapsed;
+	}
+
+	config.statsWakeups = config.wakeups;
+	config.statsTime = now;
+
+	// сводку профилировщика тоже обновляем раз в секунду, а не на каждый кадр: поиск имен функций не бесплатный
+	if (config.profiling) {
+		profilerSnapshot();
+	}
+
+	if (config.showStats) {
+		timerAdd(&config.statsTimer, 1000, editorStatsTick);
+	}
+}
+
+// Включает и выключает показ статистики
+void editorToggleStats() {
+	config.showStats = !config.showStats;
+
+	if (config.showStats) {
+		config.statsWakeups = config.wakeups;
+		clock_gettime(CLOCK_MONOTONIC, &config.statsTime);
+		timerAdd(&config.statsTimer, 1000, editorStatsTick);
+
+		if (config.profiling) {
+			profilerSnapshot();
+		}
+	} else {
+		timerCancel(&config.statsTimer);
+	}
+}
+
+// Возвращает количество строк, которые статистика занимает внизу экрана: строка счетчиков, строка задержки терминала
+// при включенном замере, а при включенном профилировщике - еще заголовок и самые горячие фазы.
+int editorStatsRows() {
+	if (!config.showStats) {
+		return 0;
+	}
+
+	return 1 + (config.termProbe ? 1 : 0) + (config.profiling ? 1 + config.profTopLen : 0);
+}
+
+// Выводит строку статистики с номером `row`
+void editorDrawStatsRow(struct abuf *ab, int row) {
+	char line[128];
+	int len = 0;
+
+	if (row == 0) {
+		len = snprintf(line, sizeof(line), "-- profile: %s | wakeups/s: %ld | key latency: %ld us",
+			config.latencyProfile == LATENCY_LOW ? "low-latency" : "power-save", config.wakeupsPerSec,
+			config.keyLatency);
+	} else if (config.termProbe && row == 1) {
+		char p50[24];
+		char p99[24];
+
+		probeFormatBucket(p50, sizeof(p50), probePercentile(50));
+		probeFormatBucket(p99, sizeof(p99), probePercentile(99));
+		len = config.probeCount
+			? snprintf(line, sizeof(line), "-- terminal rtt: %ld replies | p50 %s | p99 %s", config.probeCount, p50, p99)
+			: snprintf(line, sizeof(line), "-- terminal rtt: no replies");
+	} else {
+		// строки профилировщика идут после строки задержки терминала
+		row -= config.termProbe ? 2 : 1;
+
+		if (row == 0) {
+			len = snprintf(line, sizeof(line), "-- hotspots (%ld samples): self total function", config.profTotal);
+		} else if (row - 1 < config.profTopLen) {
+			struct editorHotspot *spot = &config.profTop[row - 1];
+			len = snprintf(line, sizeof(line), "   %3ld%% %3ld%%  %s", spot->self * 100 / config.profTotal,
+				spot->total * 100 / config.profTotal, spot->name);
+		}
+	}
+
+	// подстраховка для узких окон
+	if (len > config.screencols) {
+		len = config.screencols;
+	}
+
+	abAppend(ab, line, len);
+}
+
+// Открывает терминал для вывода без блокировки. Ставить `O_NONBLOCK` на сам `STDOUT_FILENO` нельзя: флаг относится к
+// открытому файлу, а не к дескриптору, и обычно тот же открытый файл служит и для ввода, так что `read` в потоке
+// чтения перестал бы ждать. Поэтому терминал открывается заново по имени. Если это не удалось (например, вывод
+// перенаправлен не в терминал), выводим в `STDOUT_FILENO` как раньше, с блокировкой.
+void editorOutputOpen() {
+	const char *name = isatty(STDOUT_FILENO) ? ttyname(STDOUT_FILENO) : NULL;
+
+	config.outFd = name ? open(name, O_WRONLY | O_NOCTTY | O_NONBLOCK) : -1;
+	if (config.outFd == -1) {
+		config.outFd = STDOUT_FILENO;
+	}
+
+	config.out = NULL;
+	config.outLen = 0;
+	config.outPos = 0;
+}
+
+// Завершает вывод кадра, когда терминал принял его целиком: запускает ожидание ответа на запрос DA1, считает задержку
+// от прихода клавиши и проверяет, не был ли кадр слишком медленным.
+void editorFrameWritten() {
+	struct timespec written;
+	clock_gettime(CLOCK_MONOTONIC, &written);
+
+	if (config.outProbe) {
+		config.probePending = 1;
+		config.probeOutstanding++;
+		config.probeTime = written;
+		timerAdd(&config.probeTimer, KILO_PROBE_TIMEOUT_MS, probeExpire);
+	}
+
+	// проба `kilo:frame_written`: кадр выведен, аргумент - размер кадра в байтах
+	KILO_PROBE1(frame_written, config.outLen);
+
+	// задержка от прихода клавиши до вывода кадра. Считается только для кадров, собранных после клавиши: кадры,
+	// выведенные по таймерам, к вводу отношения не имеют.
+	if (config.outKeyTime.tv_sec || config.outKeyTime.tv_nsec) {
+		config.keyLatency = timeDiffUs(&config.outKeyTime, &written);
+	}
+
+	// проверяем, не был ли кадр слишком медленным. После этого начинаем искать самую долгую клавишу заново.
+	config.writeUs = timeDiffUs(&config.outComposed, &written);
+	watchdogCheck(config.outLen);
+	config.dispatchUs = 0;
+
+	// освобождаем память
+	free(config.out);
+	config.out = NULL;
+	config.outLen = 0;
+	config.outPos = 0;
+}
+
+// Отдает терминалу столько кадра, сколько он готов принять, не дожидаясь его. Если терминал медленный (например,
+// удаленный по медленной сети), остаток кадра выводится по мере готовности терминала (см. `editorWaitInput`), а
+// клавиши в это время обрабатываются. Возвращает `1`, если кадр выведен целиком.
+int editorFlushOutput() {
+	while (config.outPos < config.outLen) {
+		int nwritten = write(config.outFd, config.out + config.outPos, config.outLen - config.outPos);
+
+		if (nwritten == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return 0;
+			}
+
+			die("write");
+		}
+
+		config.outPos += nwritten;
+	}
+
+	editorFrameWritten();
+	return 1;
+}
+
+// Дожидается, пока терминал примет остаток кадра. Нужно перед выходом, чтобы очистка экрана не смешалась с кадром.
+void editorFinishOutput() {
+	while (config.out && !editorFlushOutput()) {
+		struct pollfd pfd = {config.outFd, POLLOUT, 0};
+
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+			die("poll");
+		}
+	}
+}
+
 // выводит тильды по левому краю, как в `vim`
 // функция будет обрабатывать каждую строку редактируемого текстового буфера
 // с тильды начинаются все строки, не являющиеся частью файла. они не могут содержать текст.
@@ -383,8 +1663,11 @@ void editorDrawRows(struct abuf *ab) {
 	for (y = 0; y < config.screenrows; y++) {
 		// write(STDOUT_FILENO, "~", 1);
 
-		// выводим приветствие в первой трети экрана
-		if (y == config.screenrows / 3) {
+		// статистика занимает нижние строки экрана
+		if (y >= config.screenrows - editorStatsRows()) {
+			editorDrawStatsRow(ab, y - (config.screenrows - editorStatsRows()));
+		} else if (y == config.screenrows / 3) {
+			// выводим приветствие в первой трети экрана
 			// запись приветствия в буфер
 			char welcome[80];
 			int welcomeLen = snprintf(welcome, sizeof(welcome), "Kilo editor -- version %s", KILO_VERSION);
@@ -406,9 +1689,7 @@ void editorDrawRows(struct abuf *ab) {
 			}
 
 			// заполняем отступ слева пробелами
-			while (padding--) {
-				abAppend(ab, " ", 1);
-			}
+			abAppendSpaces(ab, padding);
 			// \центровка приветствия
 
 			// вывод приветствия
@@ -428,6 +1709,9 @@ void editorDrawRows(struct abuf *ab) {
 			abAppend(ab, "\r\n", 2);
 		}
 	}
+
+	// проба `kilo:frame_composed`: кадр собран, аргумент - размер буфера в байтах
+	KILO_PROBE1(frame_composed, ab->len);
 }
 
 // обновляет экран
@@ -438,6 +1722,10 @@ void editorRefreshScreen() {
 	// буфер для интерфейса
 	struct abuf ab = ABUF_INIT;
 
+	// время начала сборки кадра (для сторожа медленных кадров)
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	// прячем курсор
 	// команды `h` (Set Mode) и `l` (Reset Mode) используются для включения и выключения разных возможностей или
 	// режимов терминала. Значение аргумента `?25` не документировано в руководстве по `VT100`, видимо оно появилось
@@ -476,11 +1764,75 @@ void editorRefreshScreen() {
 	// показываем курсор
 	abAppend(&ab, "\x1b[?25h", 6);
 
-	// выводим содержимое буфера
-	write(STDOUT_FILENO, ab.b, ab.len);
+	// после кадра, выведенного в ответ на клавишу, отправляем запрос DA1 для замера задержки терминала. Пока не пришел
+	// ответ на предыдущий запрос (или не истекло время его ожидания), новый не отправляем.
+	int probe = config.termProbe && !config.probePending && config.probeOutstanding < KILO_PROBE_MAX_OUTSTANDING &&
+		(config.keyTime.tv_sec || config.keyTime.tv_nsec);
+	if (probe) {
+		abAppend(&ab, "\x1b[c", 3);
+	}
 
-	// освобождаем память
-	abFree(&ab);
+	// кадр собран. Клавиши, пришедшие до этого момента, в нем уже учтены, поэтому задержку до вывода для них будем
+	// считать по этому кадру, а для следующих клавиш время прихода начнет запоминаться заново.
+	clock_gettime(CLOCK_MONOTONIC, &config.outComposed);
+	config.composeUs = timeDiffUs(&start, &config.outComposed);
+	config.outKeyTime = config.keyTime;
+	config.keyTime.tv_sec = 0;
+	config.keyTime.tv_nsec = 0;
+	config.outProbe = probe;
+
+	// выводим содержимое буфера. Буфер переходит к выводу и освобождается, когда терминал примет кадр целиком
+	// (`editorFrameWritten`).
+	config.out = ab.b;
+	config.outLen = ab.len;
+	config.outPos = 0;
+	editorFlushOutput();
+}
+
+// Перед выходом дожидается ответов на отправленные запросы DA1, но не дольше `KILO_PROBE_TIMEOUT_MS`. Иначе ответ
+// придет уже после того, как `disableRawMode` сбросит ввод, и командная оболочка примет его за набранный текст.
+// Все остальное, что пришло за это время, отбрасывается.
+void probeDrain() {
+	struct timespec start;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (config.probeOutstanding > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long left = KILO_PROBE_TIMEOUT_MS - timeDiffUs(&start, &now) / 1000;
+
+		if (left <= 0) {
+			break;
+		}
+
+		// `editorReadKey` ждет ввода без ограничения по времени, поэтому вызываем его, только когда ввод уже есть
+		if (config.inputPos == config.inputLen && !editorWaitBatch((int) left)) {
+			continue;
+		}
+
+		editorReadKey();
+	}
+}
+
+// Выводит гистограмму задержки терминала за сессию (при выходе из редактора, если замер был включен)
+void probePrintHistogram() {
+	char line[80];
+	int bucket;
+
+	if (!config.termProbe || !config.probeCount) {
+		return;
+	}
+
+	// `OPOST` выключен, поэтому перевод строки - `\r\n`
+	for (bucket = 0; bucket < KILO_PROBE_BUCKETS; bucket++) {
+		char bound[24];
+		int len;
+
+		probeFormatBucket(bound, sizeof(bound), bucket);
+		len = snprintf(line, sizeof(line), "terminal rtt %10s: %ld\r\n", bound, config.probeHist[bucket]);
+		write(STDOUT_FILENO, line, len);
+	}
 }
 
 /*** input ***/
@@ -511,23 +1863,46 @@ void editorMoveCursor(int key) {
 	}
 }
 
-// Эта функция ждет введенного символа и обрабатывает его.
-void editorProcessKeypress() {
+// Эта функция ждет введенного символа и обрабатывает его. Возвращает `1`, если после обработки нужно перерисовать
+// экран, и `0`, если перерисовывать нечего (пришла не клавиша, а ответ терминала).
+int editorProcessKeypress() {
 	// считали символ. он может быть одиночным символом или началом `escape`-последовательности. Во втором случае вместо
 	// последовательности возвращается специальная константа в зависимости от того, что за `escape`-последовательность
 	// был введена.
 	int c = editorReadKey();
 
+	// ответ терминала уже учтен при разборе, экран не менялся
+	if (c == TERMINAL_REPLY) {
+		return 0;
+	}
+
+	// проба `kilo:dispatch`: клавиша передана на обработку, аргументы - код клавиши и положение курсора по вертикали
+	KILO_PROBE2(dispatch, c, config.cy);
+
+	// время начала обработки клавиши (для сторожа медленных кадров)
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	config.lastKey = c;
+
 	switch (c) {
 		case CTRL_KEY('q'):
+			// дожидаемся, пока терминал примет последний кадр, и ответов терминала на запросы DA1, чтобы они не попали
+			// в командную оболочку
+			editorFinishOutput();
+			probeDrain();
 			// очистка экрана перед выходом (см. комментарий в editorRefreshScreen)
 			// если бы мы сделали очистку в обработчике, переданном в `atexit`, мы бы не увидели, что напечатает `die`
 			write(STDOUT_FILENO, "\x1b[2J", 4);
 			// возврат курсора на место
 			write(STDOUT_FILENO, "\x1b[H", 3);
+			// итоги замера задержки терминала за сессию
+			probePrintHistogram();
 			// выход
 			exit(0);
 			break;
+		case CTRL_KEY('t'):
+			editorToggleStats();
+			break;
 		case HOME_KEY:
 			config.cx = 0;
 			break;
@@ -550,33 +1925,162 @@ void editorProcessKeypress() {
 			editorMoveCursor(c);
 			break;
 	}
+
+	// запоминаем самую долгую обработку клавиши с прошлого кадра
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (timeDiffUs(&start, &end) > config.dispatchUs) {
+		config.dispatchUs = timeDiffUs(&start, &end);
+	}
+
+	return 1;
 }
 
 /*** init ***/
+// проверяет, начинается ли значение переменной окружения `TERM` с одного из префиксов списка. Список заканчивается
+// `NULL`.
+int termMatches(const char *term, const char **prefixes) {
+	if (term == NULL) {
+		return 0;
+	}
+
+	for (; *prefixes; prefixes++) {
+		if (strncmp(term, *prefixes, strlen(*prefixes)) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Определяет по `TERM`, какие команды сжатия вывода понимает терминал. `ECH` появилась в `VT220` и есть почти везде,
+// кроме совсем старых терминалов.
+void detectTermCapabilities() {
+	static const char *echTerms[] = {"xterm", "screen", "tmux", "linux", "rxvt", "vt220", "foot", "kitty", "alacritty",
+		NULL};
+	const char *term = getenv("TERM");
+
+	config.termHasEch = termMatches(term, echTerms);
+}
+
 // Инициализация редактора: узнаем размер терминала в строках и столбцах.
 void initEditor() {
 	// текущие координаты курсора
 	config.cx = 0;
 	config.cy = 0;
 
+	// буфер ввода пуст, клавиш еще не было. Поток чтения запускается до определения размера окна: ответ терминала на
+	// запрос положения курсора тоже приходит через него.
+	editorInputStart();
+	config.inputPos = 0;
+	config.inputLen = 0;
+	config.keyTime.tv_sec = 0;
+	config.keyTime.tv_nsec = 0;
+	config.keyLatency = 0;
+
+	// колесо таймеров пусто
+	config.timerTick = 0;
+	config.timerCount = 0;
+	config.timerNext = -1;
+	clock_gettime(CLOCK_MONOTONIC, &config.timerTime);
+
+	// профиль задержки
+	const char *profile = getenv("KILO_LATENCY");
+	config.latencyProfile = profile && strcmp(profile, "low") == 0 ? LATENCY_LOW : LATENCY_POWER_SAVE;
+
+	if (config.latencyProfile == LATENCY_LOW) {
+		// закрепляем уже выделенную память процесса в ОЗУ, чтобы она не вытеснялась и обработка клавиши не ждала
+		// подкачки. Без прав на закрепление в Linux можно закрепить до `RLIMIT_MEMLOCK` байт; если память больше,
+		// `mlockall` вернет ошибку, и мы работаем без закрепления. `MCL_FUTURE` не используется: с ним закреплялась бы
+		// и вся память, выделенная позже, и после исчерпания лимита `realloc` в `abAppend` перестал бы выделять память.
+		mlockall(MCL_CURRENT);
+	}
+
+	// сторож медленных кадров
+	config.dispatchUs = 0;
+	watchdogInit();
+
+	// профилировщик
+	profilerInit();
+
+	// вывод без блокировки
+	editorOutputOpen();
+
+	// замер задержки терминала
+	config.termProbe = getenv("KILO_TERM_PROBE") != NULL;
+	config.probePending = 0;
+	config.probeOutstanding = 0;
+	config.probeCount = 0;
+
+	// статистика скрыта
+	config.wakeups = 0;
+	config.wakeupsPerSec = 0;
+	config.showStats = 0;
+
 	// чтение размеров окна
 	if (getWindowSize(&config.screenrows, &config.screencols) == -1) {
 		die("getWindowSize");
 	}
+
+	// возможности терминала для сжатия вывода
+	detectTermCapabilities();
 }
 
 /*** --- ***/
 int main() {
+	// запоминаем кадр `main` как границу стека для профилировщика (вместе с сохраненными в кадре указателем кадра и
+	// адресом возврата)
+	config.profStackTop = (uintptr_t) __builtin_frame_address(0) + 2 * sizeof(uintptr_t);
+
 	// включаем `raw`-режим
 	enableRawMode();
 	// инициализируем редактор
 	initEditor();
 
+	// рисуем интерфейс
+	editorRefreshScreen();
+
+	// нужно ли перерисовать экран
+	int dirty = 0;
+	// сколько клавиш обработано без перерисовки и когда был выведен последний кадр
+	int deferredKeys = 0;
+	struct timespec frameTime;
+	clock_gettime(CLOCK_MONOTONIC, &frameTime);
+
 	while(1) {
-		// рисуем интерфейс
-		editorRefreshScreen();
-		// обрабатываем нажатие клавиш
-		editorProcessKeypress();
+		// ждем ввода и обрабатываем нажатие клавиш. Если проснулись только из-за таймеров, обрабатывать нечего, но экран
+		// перерисовываем: таймеры могли изменить состояние редактора. Если проснулись потому, что терминал принял
+		// остаток кадра, можно выводить следующий.
+		switch (editorWaitInput()) {
+			case WAKE_INPUT:
+				dirty |= editorProcessKeypress();
+				deferredKeys++;
+				break;
+			case WAKE_TIMERS:
+				dirty = 1;
+				break;
+		}
+
+		// пока предыдущий кадр не выведен целиком, новый не собираем: он все равно ждал бы в очереди, а клавиши,
+		// пришедшие за это время, попадут в следующий кадр все сразу
+		if (!dirty || config.out) {
+			continue;
+		}
+
+		// если ввод пришел пачкой (например, при удержании клавиши или вставке), сначала обрабатываем все нажатия, а
+		// перерисовываем только последнее состояние. Так медленный вывод кадра не задерживает обработку следующих
+		// клавиш, а промежуточные кадры, которые все равно не успели бы показать, не выводятся. Но если пачка не
+		// кончается, кадр все равно выводится через `KILO_DEFER_KEYS` клавиш или `KILO_DEFER_MS` миллисекунд.
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (!editorInputPending() || deferredKeys >= KILO_DEFER_KEYS ||
+			timeDiffUs(&frameTime, &now) >= KILO_DEFER_MS * 1000L) {
+			editorRefreshScreen();
+			dirty = 0;
+			deferredKeys = 0;
+			frameTime = now;
+		}
 	}
 
 	return 0;